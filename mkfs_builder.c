@@ -1,5 +1,6 @@
 // Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_minivsfs.c -o mkfs_builder
 #define _FILE_OFFSET_BITS 64 //ensures large file support on 32-bit systems
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -10,12 +11,21 @@
 #include <assert.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define BS 4096u               
 #define INODE_SIZE 128u    
 #define ROOT_INO 1u         
 
 uint64_t g_random_seed = 0;
+int g_lazy_itable = 0;          // --lazy-itable: leave unused inode table blocks for mkfs_adder to zero
+uint32_t g_groups = 1;          // --groups
+int g_direct = 0;               // --direct: stage metadata in aligned buffers and write it with O_DIRECT
+const char *g_template_cache = NULL;    // --template-cache: directory of pristine images per format
+int g_data_csum = 0;            // --data-csum: keep a CRC32 of every data block
                            
 
 
@@ -85,6 +95,53 @@ typedef struct {
 #pragma pack(pop)
 _Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
 
+#define SB_EXT_MAGIC 0x5853564Du        // "MVSX"
+#define SB_FLAG_ITABLE_UNINIT 0x1u      // inode table slots at or past itable_hwm were never written
+#define SB_FLAG_GROUPS 0x2u             // layout is split into group_count allocation groups
+#define SB_FLAG_DATA_CSUM 0x4u          // csum_blocks blocks at csum_start hold a CRC32 per block
+#define MAX_GROUPS 64u
+#define DIRECT_CHUNK_BLOCKS 256u        // largest single write in --direct mode (1 MiB)
+
+#pragma pack(push,1)
+typedef struct {
+    // Stored in block 0 right after superblock_t, so it is covered by the superblock CRC
+    uint32_t ext_magic;
+    uint32_t ext_size;
+    uint64_t itable_hwm;          // inode slots [0, itable_hwm) of group 0 have been zeroed
+    uint32_t group_count;         // group_desc_t entries that follow the extension
+    uint32_t inodes_per_group;    // inode n lives in group (n - 1) / inodes_per_group
+    uint64_t blocks_per_group;
+    uint64_t csum_start;          // with SB_FLAG_DATA_CSUM: entry n is the CRC32 of block n
+    uint32_t csum_blocks;         // reserved in group 0's data region right after the root directory
+    uint32_t csum_reserved;
+} superblock_ext_t;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+    // Group g covers blocks [g * blocks_per_group, ...): its own bitmaps, inode table slice and data.
+    // Group 0 is the classic layout and matches the superblock's own layout fields.
+    uint64_t inode_bitmap_start;
+    uint64_t data_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t data_region_start;
+    uint32_t inode_table_blocks;
+    uint32_t data_region_blocks;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t itable_hwm;          // inode slots of this group's table that have been zeroed
+    uint32_t reserved;
+} group_desc_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) + sizeof(superblock_ext_t) + MAX_GROUPS * sizeof(group_desc_t) <= BS - 4,
+               "group descriptors must fit in block 0");
+
+group_desc_t g_group_desc[MAX_GROUPS];     // filled by plan_groups()
+uint32_t g_inodes_per_group = 0;
+uint64_t g_blocks_per_group = 0;
+uint32_t g_csum_blocks = 0;                 // checksum table size, 0 without --data-csum
+uint32_t g_root_block_crc = 0;              // set by write_root_directory() for the table
+
 
 // ==========================DO NOT CHANGE THIS PORTION=========================
 // These functions are there for your help. You should refer to the specifications to see how you can use them.
@@ -139,14 +196,25 @@ void write_bitmaps(FILE *fp, uint32_t size_kib, uint32_t inodes);
 void write_inode_table(FILE *fp, uint32_t inodes);
 void write_root_directory(FILE *fp, uint32_t size_kib, uint32_t inodes);
 void write_data_blocks(FILE *fp, uint32_t size_kib, uint32_t inodes);
+int plan_groups(uint32_t size_kib, uint32_t inodes);
+void write_group(FILE *fp, uint32_t g);
+void write_image_direct(const char *image_name, uint32_t size_kib, uint32_t inodes);
+void write_csum_table(FILE *fp);
+int clone_image(const char *src, const char *dst, uint64_t expected_size);
+void stamp_image(const char *image_name);
 
 
 
 void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s --image <image> --size-kib <180..4096> --inodes <128..512>\n", program_name);
+    fprintf(stderr, "Usage: %s --image <image> --size-kib <180..4096> --inodes <128..512> [--groups <1..64>] [--lazy-itable] [--direct] [--data-csum] [--template-cache <dir>]\n", program_name);
     fprintf(stderr, " --image : output image filename\n");
-    fprintf(stderr, " --size-kib : total size in KiB (multiple of 4)\n");
-    fprintf(stderr, " --inodes : number of inodes\n");
+    fprintf(stderr, " --size-kib : total size in KiB (multiple of 4; up to 4096 per group)\n");
+    fprintf(stderr, " --inodes : number of inodes (up to 512 per group)\n");
+    fprintf(stderr, " --groups : split the image into allocation groups\n");
+    fprintf(stderr, " --lazy-itable : only write the used part of the inode table\n");
+    fprintf(stderr, " --direct : write with O_DIRECT in large aligned chunks, bypassing the page cache\n");
+    fprintf(stderr, " --data-csum : keep a CRC32 of every data block for mkfs_scrub\n");
+    fprintf(stderr, " --template-cache : clone a cached pristine image of the same format instead of formatting\n");
 }
 
 
@@ -158,10 +226,15 @@ int parse_arguments(int argc, char *argv[], char **image_name, uint32_t *size_ki
         {"image", required_argument, 0, 'i'},
         {"size-kib", required_argument, 0, 's'},
         {"inodes", required_argument, 0, 'n'},
+        {"lazy-itable", no_argument, 0, 'l'},
+        {"groups", required_argument, 0, 'g'},
+        {"direct", no_argument, 0, 'D'},
+        {"template-cache", required_argument, 0, 'T'},
+        {"data-csum", no_argument, 0, 'c'},
         {0, 0, 0, 0}
     };
     
-    while ((opt = getopt_long(argc, argv, "i:s:n:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:s:n:lg:DT:c", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
                 *image_name = optarg;
@@ -169,19 +242,30 @@ int parse_arguments(int argc, char *argv[], char **image_name, uint32_t *size_ki
                 break;
             case 's':
                 *size_kib = atoi(optarg);
-                if (*size_kib < 180 || *size_kib > 4096 || (*size_kib % 4 != 0)) {
-                    fprintf(stderr, "Error: size-kib must be between 180 and 4096 and multiple of 4\n");
-                    return -1;
-                }
                 size_set = 1;
                 break;
             case 'n':
                 *inodes = atoi(optarg);
-                if (*inodes < 128 || *inodes > 512) {
-                    fprintf(stderr, "Error: inodes must be between 128 and 512\n");
+                inodes_set = 1;
+                break;
+            case 'l':
+                g_lazy_itable = 1;
+                break;
+            case 'D':
+                g_direct = 1;
+                break;
+            case 'T':
+                g_template_cache = optarg;
+                break;
+            case 'c':
+                g_data_csum = 1;
+                break;
+            case 'g':
+                g_groups = atoi(optarg);
+                if (g_groups < 1 || g_groups > MAX_GROUPS) {
+                    fprintf(stderr, "Error: groups must be between 1 and %u\n", MAX_GROUPS);
                     return -1;
                 }
-                inodes_set = 1;
                 break;
             default:
                 print_usage(argv[0]);
@@ -194,10 +278,65 @@ int parse_arguments(int argc, char *argv[], char **image_name, uint32_t *size_ki
         print_usage(argv[0]);
         return -1;
     }
+    if (*size_kib < 180 || *size_kib > 4096 * g_groups || (*size_kib % 4 != 0)) {
+        fprintf(stderr, "Error: size-kib must be between 180 and %u and multiple of 4\n", 4096 * g_groups);
+        return -1;
+    }
+    if (*inodes < 128 || *inodes > 512 * g_groups) {
+        fprintf(stderr, "Error: inodes must be between 128 and %u\n", 512 * g_groups);
+        return -1;
+    }
     
     return 0;
 }
 
+// Splits the image into g_groups groups of equal size (the last one takes the remainder) and
+// fills g_group_desc. Group 0 keeps the classic layout after the superblock; every other group
+// starts with its own inode bitmap, data bitmap and inode table slice.
+int plan_groups(uint32_t size_kib, uint32_t inodes) {
+    uint64_t total_blocks = (uint64_t)size_kib * 1024 / 4096;
+    g_inodes_per_group = (inodes + g_groups - 1) / g_groups;
+    g_blocks_per_group = total_blocks / g_groups;
+    uint32_t itable_blocks = (g_inodes_per_group * INODE_SIZE + BS - 1) / BS;
+
+    for (uint32_t g = 0; g < g_groups; g++) {
+        group_desc_t *gd = &g_group_desc[g];
+        uint64_t start = g * g_blocks_per_group;
+        uint64_t end = (g + 1 == g_groups) ? total_blocks : start + g_blocks_per_group;
+        uint64_t meta = (g == 0) ? 1 : start;    // group 0 is preceded by the superblock
+
+        memset(gd, 0, sizeof(*gd));
+        gd->inode_bitmap_start = meta;
+        gd->data_bitmap_start = meta + 1;
+        gd->inode_table_start = meta + 2;
+        gd->inode_table_blocks = itable_blocks;
+        gd->data_region_start = meta + 2 + itable_blocks;
+        if (end <= gd->data_region_start || end - gd->data_region_start > BS * 8) {
+            fprintf(stderr, "Error: no space for data region in group %u (image too small)\n", g);
+            return -1;
+        }
+        gd->data_region_blocks = (uint32_t)(end - gd->data_region_start);
+        gd->free_inodes = g_inodes_per_group;
+        gd->free_blocks = gd->data_region_blocks;
+        gd->itable_hwm = itable_blocks * (BS / INODE_SIZE);
+        if (g_lazy_itable && (g > 0 || itable_blocks > 1)) {
+            gd->itable_hwm = (g == 0) ? BS / INODE_SIZE : 0;
+        }
+    }
+    g_group_desc[0].free_inodes--;     // root inode
+    g_group_desc[0].free_blocks--;     // root directory block
+
+    if (g_data_csum) {
+        g_csum_blocks = (uint32_t)((total_blocks * sizeof(uint32_t) + BS - 1) / BS);
+        if (g_group_desc[0].data_region_blocks <= 1 + g_csum_blocks) {
+            fprintf(stderr, "Error: no space for the checksum table in group 0\n");
+            return -1;
+        }
+        g_group_desc[0].free_blocks -= g_csum_blocks;
+    }
+    return 0;
+}
+
 void create_file_system(const char *image_name, uint32_t size_kib, uint32_t inodes) {
     FILE *fp = fopen(image_name, "wb");
     if (!fp) {
@@ -206,42 +345,56 @@ void create_file_system(const char *image_name, uint32_t size_kib, uint32_t inod
     }
 
 
-    uint64_t total_blocks = (uint64_t)size_kib * 1024 / 4096;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;
-    uint64_t data_region_start = 3 + inode_table_blocks; 
-    uint64_t data_region_blocks = (total_blocks >= data_region_start) ? (total_blocks - data_region_start) : 0;
-    if (data_region_blocks == 0) {
-        fprintf(stderr, "Error: no space for data region (image too small)\n");
+    if (plan_groups(size_kib, inodes) != 0) {
         fclose(fp);
         exit(1);
     }
 
 
     printf("Creating MiniVSFS file system:\n");
-    printf(" Total blocks: %" PRIu64 "\n", total_blocks);
-    printf(" Inode table blocks: %" PRIu64 "\n", inode_table_blocks);
-    printf(" Data region start: %" PRIu64 "\n", data_region_start);
-    printf(" Data region blocks: %" PRIu64 "\n", data_region_blocks);
+    printf(" Total blocks: %" PRIu64 "\n", (uint64_t)size_kib * 1024 / 4096);
+    if (g_groups > 1) {
+        printf(" Groups: %u (%" PRIu64 " blocks, %u inodes each)\n", g_groups, g_blocks_per_group, g_inodes_per_group);
+    }
+    printf(" Inode table blocks: %u\n", g_group_desc[0].inode_table_blocks);
+    printf(" Data region start: %" PRIu64 "\n", g_group_desc[0].data_region_start);
+    printf(" Data region blocks: %u\n", g_group_desc[0].data_region_blocks);
 
 
-    write_superblock(fp, size_kib, inodes);
+    if (g_direct) {
+        write_image_direct(image_name, size_kib, inodes);
+    } else {
+        write_superblock(fp, size_kib, inodes);
 
 
-    write_bitmaps(fp, size_kib, inodes);
+        write_bitmaps(fp, size_kib, inodes);
 
 
    
-    write_inode_table(fp, inodes);
+        write_inode_table(fp, g_inodes_per_group);
 
 
  
-    write_root_directory(fp, size_kib, inodes);
+        write_root_directory(fp, size_kib, inodes);
+        if (g_data_csum) write_csum_table(fp);
 
 
   
-    write_data_blocks(fp, size_kib, inodes);
+        write_data_blocks(fp, size_kib, inodes);
+
 
+        for (uint32_t g = 1; g < g_groups; g++) {
+            write_group(fp, g);
+        }
+    }
 
+
+    fflush(fp);
+    if (ftruncate(fileno(fp), (off_t)size_kib * 1024) != 0) {
+        perror("Error setting image size");
+        fclose(fp);
+        exit(1);
+    }
     fclose(fp);
     printf("File system created successfully: %s\n", image_name);
 }
@@ -250,42 +403,58 @@ void create_file_system(const char *image_name, uint32_t size_kib, uint32_t inod
 
 
 void write_superblock(FILE *fp, uint32_t size_kib, uint32_t inodes) {
+    // Built in a full block so the CRC, which spans BS - 4 bytes, also covers the extension
+    uint8_t sb_block[BS];
+    memset(sb_block, 0, BS);
     superblock_t sb = {0};
+    superblock_ext_t ext = {0};
 
 
     sb.magic = 0x4D565346; 
     sb.version = 1;
     sb.block_size = 4096;
     sb.total_blocks = (uint64_t)size_kib * 1024 / 4096;
-    sb.inode_count = inodes;
+    (void)inodes;
+    sb.inode_count = (uint64_t)g_inodes_per_group * g_groups;
     sb.inode_bitmap_start = 1;
     sb.inode_bitmap_blocks = 1;
     sb.data_bitmap_start = 2;
     sb.data_bitmap_blocks = 1;
     sb.inode_table_start = 3;
-    sb.inode_table_blocks = (inodes * INODE_SIZE + 4096 - 1) / 4096;
-    sb.data_region_start = 3 + sb.inode_table_blocks;
-    sb.data_region_blocks = (sb.total_blocks >= sb.data_region_start) ? (sb.total_blocks - sb.data_region_start) : 0;
-    if (sb.data_region_blocks == 0) {
-        fprintf(stderr, "Error: no space for data region (image too small)\n");
-        exit(1);
-    }
+    sb.inode_table_blocks = g_group_desc[0].inode_table_blocks;
+    sb.data_region_start = g_group_desc[0].data_region_start;
+    sb.data_region_blocks = g_group_desc[0].data_region_blocks;
 
-    sb.flags = 0;
+    sb.flags = (g_groups > 1) ? SB_FLAG_GROUPS : 0;
     sb.root_inode = ROOT_INO; 
     sb.mtime_epoch = time(NULL);
 
+    ext.ext_magic = SB_EXT_MAGIC;
+    ext.ext_size = sizeof(ext);
+    ext.itable_hwm = g_group_desc[0].itable_hwm;
+    ext.group_count = g_groups;
+    ext.inodes_per_group = g_inodes_per_group;
+    ext.blocks_per_group = g_blocks_per_group;
+    if (g_data_csum) {
+        sb.flags |= SB_FLAG_DATA_CSUM;
+        ext.csum_start = g_group_desc[0].data_region_start + 1;
+        ext.csum_blocks = g_csum_blocks;
+    }
+    for (uint32_t g = 0; g < g_groups; g++) {
+        if (g_group_desc[g].itable_hwm < g_group_desc[g].inode_table_blocks * (BS / INODE_SIZE)) {
+            sb.flags |= SB_FLAG_ITABLE_UNINIT;
+        }
+    }
+
 
-    superblock_crc_finalize(&sb);
+    memcpy(sb_block, &sb, sizeof(sb));
+    memcpy(sb_block + sizeof(sb), &ext, sizeof(ext));
+    memcpy(sb_block + sizeof(sb) + sizeof(ext), g_group_desc, g_groups * sizeof(group_desc_t));
+    superblock_crc_finalize((superblock_t *)sb_block);
 
 
   
-    fwrite(&sb, sizeof(sb), 1, fp);
-    
-   
-    uint8_t padding[BS - sizeof(sb)];
-    memset(padding, 0, sizeof(padding));
-    fwrite(padding, sizeof(padding), 1, fp);
+    if (fwrite(sb_block, BS, 1, fp) != 1) { perror("fwrite superblock"); exit(1);}
 }
 
 
@@ -304,6 +473,7 @@ void write_bitmaps(FILE *fp, uint32_t size_kib, uint32_t inodes) {
  
     uint8_t data_bitmap[BS]; memset(data_bitmap, 0, BS);
     data_bitmap[0] |= 0x01; 
+    for (uint32_t i = 1; i <= g_csum_blocks; i++) data_bitmap[i / 8] |= (1 << (i % 8));
     if (fwrite(data_bitmap, BS, 1, fp) != 1) { perror("fwrite data bitmap"); exit(1);}
 }
 
@@ -344,6 +514,14 @@ void write_inode_table(FILE *fp, uint32_t inodes) {
    
     inode_t empty_inode; 
     memset(&empty_inode, 0, sizeof(empty_inode)); 
+    if (g_lazy_itable && inode_table_blocks > 1) {
+        // Fill out the root inode's block and skip the rest; mkfs_adder zeroes blocks as it allocates into them
+        for (uint64_t i = 1; i < BS / INODE_SIZE; i++) {
+            if (fwrite(&empty_inode, sizeof(empty_inode), 1, fp) != 1) { perror("fwrite inode"); exit(1);}
+        }
+        if (fseeko(fp, (off_t)data_region_start * BS, SEEK_SET) != 0) { perror("fseek past inode table"); exit(1);}
+        return;
+    }
     for (uint32_t i = 1; i < inodes; i++) {
         if (fwrite(&empty_inode, sizeof(empty_inode), 1, fp) != 1) { perror("fwrite inode"); exit(1);}
     }
@@ -377,33 +555,192 @@ void write_root_directory(FILE *fp, uint32_t size_kib, uint32_t inodes) {
     dirent_checksum_finalize(&dotdot_entry);
     
   
-    fwrite(&dot_entry, sizeof(dot_entry), 1, fp);
-    fwrite(&dotdot_entry, sizeof(dotdot_entry), 1, fp);
-    
-   
-    uint8_t padding[BS - 2 * sizeof(dirent64_t)];
-    memset(padding, 0, sizeof(padding));
-    fwrite(padding, sizeof(padding), 1, fp);
+    uint8_t block[BS];
+    memset(block, 0, BS);
+    memcpy(block, &dot_entry, sizeof(dot_entry));
+    memcpy(block + sizeof(dot_entry), &dotdot_entry, sizeof(dotdot_entry));
+    g_root_block_crc = crc32(block, BS);
+    if (fwrite(block, BS, 1, fp) != 1) { perror("fwrite root directory"); exit(1);}
+}
+
+
+// Follows the root directory block. Only the root directory is in use, so every other entry is 0.
+void write_csum_table(FILE *fp) {
+    uint32_t *table = calloc(g_csum_blocks, BS);
+    if (!table) { perror("calloc checksum table"); exit(1);}
+    table[g_group_desc[0].data_region_start] = g_root_block_crc;
+    if (fwrite(table, BS, g_csum_blocks, fp) != g_csum_blocks) { perror("fwrite checksum table"); exit(1);}
+    free(table);
 }
 
 
 void write_data_blocks(FILE *fp, uint32_t size_kib, uint32_t inodes) {
    
-    uint64_t total_blocks = (uint64_t)size_kib * 1024 / 4096;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + 4096 - 1) / 4096;
-    uint64_t data_region_start = 3 + inode_table_blocks;
-    uint64_t data_region_blocks = (total_blocks >= data_region_start) ? (total_blocks - data_region_start) : 0;
+    (void)size_kib; (void)inodes;
+    uint64_t data_region_blocks = g_group_desc[0].data_region_blocks;
 
 
     if (data_region_blocks == 0) return; 
 
 
-    
-    uint8_t zero_block[BS]; 
+    // Free data blocks are left as a hole (create_file_system sets the final length), so an
+    // empty image costs no disk space and mkfs_adder can punch freed blocks back out later
+    uint64_t data_end = g_group_desc[0].data_region_start + data_region_blocks;
+    if (fseeko(fp, (off_t)data_end * BS, SEEK_SET) != 0) { perror("fseek past data region"); exit(1);}
+}
+
+
+void write_group(FILE *fp, uint32_t g) {
+    const group_desc_t *gd = &g_group_desc[g];
+    uint8_t zero_block[BS];
     memset(zero_block, 0, BS);
-    for (uint64_t i = 1; i < data_region_blocks; i++) {
-        if (fwrite(zero_block, BS, 1, fp) != 1) { perror("fwrite data block"); exit(1);}
+
+    if (fseeko(fp, (off_t)gd->inode_bitmap_start * BS, SEEK_SET) != 0) { perror("fseek group"); exit(1);}
+    if (fwrite(zero_block, BS, 1, fp) != 1) { perror("fwrite group inode bitmap"); exit(1);}
+    if (fwrite(zero_block, BS, 1, fp) != 1) { perror("fwrite group data bitmap"); exit(1);}
+
+    if (gd->itable_hwm == 0) {
+        if (fseeko(fp, (off_t)gd->data_region_start * BS, SEEK_SET) != 0) { perror("fseek past inode table"); exit(1);}
+    } else {
+        for (uint32_t i = 0; i < gd->inode_table_blocks; i++) {
+            if (fwrite(zero_block, BS, 1, fp) != 1) { perror("fwrite group inode table"); exit(1);}
+        }
+    }
+
+    if (fseeko(fp, (off_t)(gd->data_region_start + gd->data_region_blocks) * BS, SEEK_SET) != 0) {
+        perror("fseek past data region"); exit(1);
+    }
+}
+
+
+static void pwrite_blocks(int fd, const uint8_t *buf, uint64_t first_block, uint64_t nblocks) {
+    for (uint64_t done = 0; done < nblocks; ) {
+        uint64_t n = nblocks - done < DIRECT_CHUNK_BLOCKS ? nblocks - done : DIRECT_CHUNK_BLOCKS;
+        ssize_t w = pwrite(fd, buf + done * BS, n * BS, (off_t)(first_block + done) * BS);
+        if (w != (ssize_t)(n * BS)) { perror("pwrite image"); exit(1);}
+        done += n;
+    }
+}
+
+// The metadata of each group is contiguous, so it is assembled in one aligned buffer (group 0
+// through the same write_* functions, via fmemopen) and sent down in DIRECT_CHUNK_BLOCKS pieces.
+// Inode table blocks the buffered path would skip stay holes here too.
+void write_image_direct(const char *image_name, uint32_t size_kib, uint32_t inodes) {
+    int drop_cache = 0;
+    int fd = open(image_name, O_WRONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // e.g. tmpfs: write normally and drop the pages afterwards instead
+        fprintf(stderr, "Warning: O_DIRECT not supported for '%s', falling back to buffered writes\n", image_name);
+        fd = open(image_name, O_WRONLY);
+        drop_cache = 1;
+    }
+    if (fd < 0) { perror("open image for direct I/O"); exit(1);}
+
+    for (uint32_t g = 0; g < g_groups; g++) {
+        const group_desc_t *gd = &g_group_desc[g];
+        uint64_t first = (g == 0) ? 0 : gd->inode_bitmap_start;
+        uint64_t nblocks = gd->data_region_start - first + (g == 0 ? 1 + g_csum_blocks : 0);   // + root directory
+        uint8_t *buf;
+        if (posix_memalign((void **)&buf, BS, nblocks * BS) != 0) { perror("posix_memalign"); exit(1);}
+        memset(buf, 0, nblocks * BS);
+
+        if (g == 0) {
+            FILE *mem = fmemopen(buf, nblocks * BS, "r+");
+            if (!mem) { perror("fmemopen"); exit(1);}
+            write_superblock(mem, size_kib, inodes);
+            write_bitmaps(mem, size_kib, inodes);
+            write_inode_table(mem, g_inodes_per_group);
+            write_root_directory(mem, size_kib, inodes);
+            if (g_data_csum) write_csum_table(mem);
+            fclose(mem);
+        }
+
+        uint64_t itable_written = ((uint64_t)gd->itable_hwm * INODE_SIZE + BS - 1) / BS;
+        uint64_t hole_start = gd->inode_table_start + itable_written;
+        uint64_t hole_end = gd->data_region_start;
+        pwrite_blocks(fd, buf, first, hole_start - first);
+        pwrite_blocks(fd, buf + (hole_end - first) * BS, hole_end, first + nblocks - hole_end);
+        free(buf);
+    }
+
+    if (drop_cache) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (close(fd) != 0) { perror("close image"); exit(1);}
+}
+
+
+// Copies src to a new dst as a reflink when the filesystem supports it, otherwise with
+// copy_file_range over src's data extents only, so the holes of the template stay holes.
+// Returns -1 without creating dst if src is missing or not expected_size bytes long.
+int clone_image(const char *src, const char *dst, uint64_t expected_size) {
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+    struct stat st;
+    if (fstat(in, &st) != 0 || (uint64_t)st.st_size != expected_size) {
+        close(in);
+        return -1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Error opening output file");
+        close(in);
+        return -1;
+    }
+
+    int rc = 0;
+    if (ioctl(out, FICLONE, in) != 0) {
+        for (off_t off = 0; off < st.st_size && rc == 0; ) {
+            off_t data = lseek(in, off, SEEK_DATA);
+            if (data < 0) break;        // only a hole is left
+            off_t hole = lseek(in, data, SEEK_HOLE);
+            off_t pos_in = data, pos_out = data;
+            while (pos_in < hole) {
+                ssize_t n = copy_file_range(in, &pos_in, out, &pos_out, hole - pos_in, 0);
+                if (n <= 0) {
+                    perror("copy_file_range");
+                    rc = -1;
+                    break;
+                }
+            }
+            off = hole;
+        }
+        if (rc == 0 && ftruncate(out, st.st_size) != 0) rc = -1;
     }
+    close(in);
+    if (close(out) != 0) rc = -1;
+    return rc;
+}
+
+// Gives a cloned template the timestamps a fresh format would have: the superblock's
+// mtime_epoch and the root inode's times, each followed by its checksum.
+void stamp_image(const char *image_name) {
+    int fd = open(image_name, O_RDWR);
+    if (fd < 0) { perror("open template clone"); exit(1);}
+
+    uint8_t sb_block[BS];
+    if (pread(fd, sb_block, BS, 0) != BS) { perror("read superblock"); exit(1);}
+    superblock_t *sb = (superblock_t *)sb_block;
+    if (sb->magic != 0x4D565346) {
+        fprintf(stderr, "Error: template for '%s' is not a MiniVSFS image\n", image_name);
+        exit(1);
+    }
+    uint64_t now = time(NULL);
+    sb->mtime_epoch = now;
+    superblock_crc_finalize(sb);
+
+    inode_t root_inode;
+    off_t root_off = (off_t)sb->inode_table_start * BS + (ROOT_INO - 1) * INODE_SIZE;
+    if (pread(fd, &root_inode, sizeof(root_inode), root_off) != sizeof(root_inode)) { perror("read root inode"); exit(1);}
+    root_inode.atime = now;
+    root_inode.mtime = now;
+    root_inode.ctime = now;
+    inode_crc_finalize(&root_inode);
+
+    if (pwrite(fd, sb_block, BS, 0) != BS) { perror("write superblock"); exit(1);}
+    if (pwrite(fd, &root_inode, sizeof(root_inode), root_off) != sizeof(root_inode)) { perror("write root inode"); exit(1);}
+    if (close(fd) != 0) { perror("close image"); exit(1);}
 }
 
 
@@ -421,8 +758,30 @@ int main(int argc, char *argv[]) {
 
 
 
+    if (!g_template_cache) {
+        create_file_system(image_name, size_kib, inodes);
+        return 0;
+    }
+
+    // Templates are keyed by everything that shapes the layout
+    char template_name[4096], temp_name[4096 + 32];
+    snprintf(template_name, sizeof(template_name), "%s/minivsfs-v1-%uk-%ui-%ug%s%s.img", g_template_cache,
+             size_kib, inodes, g_groups, g_lazy_itable ? "-lazy" : "", g_data_csum ? "-csum" : "");
+    if (clone_image(template_name, image_name, (uint64_t)size_kib * 1024) == 0) {
+        stamp_image(image_name);
+        printf("File system created from template %s: %s\n", template_name, image_name);
+        return 0;
+    }
+
     create_file_system(image_name, size_kib, inodes);
 
+    // Publish atomically so concurrent builders never clone a half-written template
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp.%ld", template_name, (long)getpid());
+    if (clone_image(image_name, temp_name, (uint64_t)size_kib * 1024) != 0 || rename(temp_name, template_name) != 0) {
+        fprintf(stderr, "Warning: cannot store template '%s': %s\n", template_name, strerror(errno));
+        unlink(temp_name);
+    }
+
 
     return 0;
 }
@@ -0,0 +1,623 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_query.c -o mkfs_query
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define MAX_IMAGES 4096u
+#define MAX_THREADS 64u
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;
+} superblock_t;
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+typedef struct __attribute__((packed)) {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t reserved_2;
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+typedef struct __attribute__((packed)) {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define SB_EXT_MAGIC 0x5853564Du        // "MVSX"
+#define SB_EXT_SIZE_V1 32u              // extension without the checksum table fields
+#define MAX_GROUPS 64u
+
+// Stored in block 0 right after superblock_t, so it is covered by the superblock CRC
+typedef struct __attribute__((packed)) {
+    uint32_t ext_magic;
+    uint32_t ext_size;
+    uint64_t itable_hwm;
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint64_t blocks_per_group;
+} superblock_ext_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t inode_bitmap_start;
+    uint64_t data_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t data_region_start;
+    uint32_t inode_table_blocks;
+    uint32_t data_region_blocks;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t itable_hwm;
+    uint32_t reserved;
+} group_desc_t;
+
+// ==========================DO NOT CHANGE THIS PORTION=========================
+// These functions are there for your help. You should refer to the specifications to see how you can use them.
+// ====================================CRC32====================================
+uint32_t CRC32_TAB[256];
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+// ====================================CRC32====================================
+
+#define CRC_VALID (1ull << 32)
+
+// A regular file of the root directory with a copy of its inode
+typedef struct {
+    char name[58];
+    uint32_t inode_no;
+    inode_t inode;
+    _Atomic uint64_t crc;         // CRC_VALID | CRC32 of the contents, computed on first use
+} file_entry_t;
+
+// Everything parsed from one version of an image. A snapshot never changes after it is
+// published, so readers use it without locks; a newer version replaces it as a whole.
+typedef struct snapshot {
+    const uint8_t *base;          // read-only mapping of the image file
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t retired_epoch;       // value of query_cache_t.epoch when it was replaced
+    superblock_t sb;
+    uint32_t file_count;
+    file_entry_t files[BS / sizeof(dirent64_t)];   // sorted by name
+    struct snapshot *next_retired;
+} snapshot_t;
+
+typedef struct {
+    char *path;                   // immutable once the slot is published
+    uint64_t hash;
+    _Atomic(snapshot_t *) snap;   // NULL until first loaded
+} image_slot_t;
+
+typedef struct {
+    image_slot_t slots[MAX_IMAGES];
+    _Atomic uint32_t slot_count;  // slots [0, slot_count) are fully initialised
+    pthread_mutex_t add_lock;     // serialises adding slots, never taken by lookups
+
+    // Replaced snapshots are freed once every request still running started after the
+    // replacement. A worker publishes the epoch its current request started in, 0 when idle.
+    atomic_uint_fast64_t epoch;
+    atomic_uint_fast64_t reader_epoch[MAX_THREADS];
+    pthread_mutex_t retire_lock;
+    snapshot_t *retired;
+    atomic_uint retired_count;
+
+    pthread_mutex_t input_lock;
+    atomic_uint_fast64_t requests, refreshes;
+} query_cache_t;
+
+typedef struct {
+    query_cache_t *cache;
+    uint32_t id;                  // index into reader_epoch
+} worker_t;
+
+void print_usage(const char *program_name);
+snapshot_t *load_snapshot(const char *path, char *err, size_t err_size);
+void free_snapshot(snapshot_t *snap);
+void reclaim_snapshots(query_cache_t *cache);
+snapshot_t *get_snapshot(query_cache_t *cache, const char *path, char *err, size_t err_size);
+file_entry_t *find_file(snapshot_t *snap, const char *name);
+int read_file(const snapshot_t *snap, const file_entry_t *f, uint8_t *data);
+int file_crc(const snapshot_t *snap, file_entry_t *f, uint32_t *crc);
+void handle_request(query_cache_t *cache, char *line, FILE *out);
+void *query_worker(void *arg);
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [--threads <1..%u>] < requests\n", program_name, MAX_THREADS);
+    fprintf(stderr, "  --threads : number of worker threads serving requests (default: 4)\n");
+    fprintf(stderr, "Requests, one per line:\n");
+    fprintf(stderr, "  stat <image> <name>   size, mtime, inode and content CRC32 of a file\n");
+    fprintf(stderr, "  list <image>          every regular file of the root directory\n");
+    fprintf(stderr, "  read <image> <name>   file contents, preceded by their length\n");
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const file_entry_t *)a)->name, ((const file_entry_t *)b)->name);
+}
+
+static _Thread_local sigjmp_buf *bus_guard;   // set while this thread copies from a mapping
+
+// Shrinking a mapped file in place turns accesses past the new end into SIGBUS. Inside
+// copy_from_map() that only fails the copy; anywhere else it is fatal as usual.
+static void sigbus_handler(int sig) {
+    if (bus_guard) siglongjmp(*bus_guard, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static int copy_from_map(void *dst, const uint8_t *src, size_t len) {
+    sigjmp_buf env;
+    if (sigsetjmp(env, 0)) {
+        bus_guard = NULL;
+        return -1;
+    }
+    bus_guard = &env;
+    atomic_signal_fence(memory_order_seq_cst);    // keep the copy between the two stores
+    memcpy(dst, src, len);
+    atomic_signal_fence(memory_order_seq_cst);
+    bus_guard = NULL;
+    return 0;
+}
+
+// Maps the image and copies out the superblock, the root directory and the inodes it names.
+// File data stays in the mapping and is only touched by read and stat requests.
+snapshot_t *load_snapshot(const char *path, char *err, size_t err_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, err_size, "cannot open: %s", strerror(errno));
+        return NULL;
+    }
+    // The identity recorded is that of the file actually mapped, even if path was replaced meanwhile
+    struct stat file_st, *st = &file_st;
+    if (fstat(fd, st) != 0 || (size_t)st->st_size < BS) {
+        snprintf(err, err_size, "image too small");
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        snprintf(err, err_size, "cannot map: %s", strerror(errno));
+        return NULL;
+    }
+
+    snapshot_t *snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        munmap(base, st->st_size);
+        snprintf(err, err_size, "out of memory");
+        return NULL;
+    }
+    snap->base = base;
+    snap->size = st->st_size;
+    snap->dev = st->st_dev;
+    snap->ino = st->st_ino;
+    snap->mtime = st->st_mtim;
+
+    uint8_t sb_block[BS];
+    dirent64_t root[BS / sizeof(dirent64_t)];
+    if (copy_from_map(sb_block, snap->base, BS) != 0) {
+        snprintf(err, err_size, "image truncated while loading");
+        free_snapshot(snap);
+        return NULL;
+    }
+    memcpy(&snap->sb, sb_block, sizeof(snap->sb));
+    memset(sb_block + offsetof(superblock_t, checksum), 0, sizeof(uint32_t));
+    if (snap->sb.magic != 0x4D565346 || crc32(sb_block, BS - 4) != snap->sb.checksum) {
+        snprintf(err, err_size, "not a MiniVSFS image or bad superblock checksum");
+        free_snapshot(snap);
+        return NULL;
+    }
+
+    // Inode n lives in group (n - 1) / inodes_per_group; images without groups are one group
+    superblock_ext_t ext;
+    memcpy(&ext, sb_block + sizeof(snap->sb), sizeof(ext));
+    group_desc_t groups[MAX_GROUPS];
+    uint32_t group_count = 1, inodes_per_group = (uint32_t)snap->sb.inode_count;
+    groups[0].inode_table_start = snap->sb.inode_table_start;
+    if (ext.ext_magic == SB_EXT_MAGIC && ext.ext_size >= SB_EXT_SIZE_V1 && ext.group_count > 0 &&
+        ext.group_count <= MAX_GROUPS && ext.inodes_per_group > 0 &&
+        sizeof(snap->sb) + ext.ext_size + ext.group_count * sizeof(group_desc_t) <= BS) {
+        group_count = ext.group_count;
+        inodes_per_group = ext.inodes_per_group;
+        memcpy(groups, sb_block + sizeof(snap->sb) + ext.ext_size, group_count * sizeof(group_desc_t));
+    }
+
+    if ((snap->sb.data_region_start + 1) * BS > snap->size) {
+        snprintf(err, err_size, "root directory outside the image");
+        free_snapshot(snap);
+        return NULL;
+    }
+    if (copy_from_map(root, snap->base + snap->sb.data_region_start * BS, BS) != 0) {
+        snprintf(err, err_size, "image truncated while loading");
+        free_snapshot(snap);
+        return NULL;
+    }
+    for (size_t i = 0; i < BS / sizeof(dirent64_t); i++) {
+        uint32_t n = root[i].inode_no;
+        if (n == 0 || root[i].type != 1) continue;
+        uint32_t g = (n - 1) / inodes_per_group;
+        if (g >= group_count) continue;
+        uint64_t off = groups[g].inode_table_start * BS + (uint64_t)((n - 1) % inodes_per_group) * INODE_SIZE;
+        if (off + INODE_SIZE > snap->size) continue;
+
+        file_entry_t *f = &snap->files[snap->file_count];
+        if (copy_from_map(&f->inode, snap->base + off, sizeof(f->inode)) != 0) {
+            snprintf(err, err_size, "image truncated while loading");
+            free_snapshot(snap);
+            return NULL;
+        }
+        memcpy(f->name, root[i].name, sizeof(f->name));
+        f->name[sizeof(f->name) - 1] = '\0';
+        f->inode_no = n;
+        snap->file_count++;
+    }
+    qsort(snap->files, snap->file_count, sizeof(file_entry_t), compare_entries);
+    return snap;
+}
+
+void free_snapshot(snapshot_t *snap) {
+    munmap((void *)snap->base, snap->size);
+    free(snap);
+}
+
+// A request that started in epoch e can only hold snapshots retired after e, so everything
+// retired at or before the oldest running request's epoch is unreachable. The epoch is read
+// before the workers so a snapshot retired during the scan is left for a later pass.
+void reclaim_snapshots(query_cache_t *cache) {
+    uint64_t oldest = atomic_load(&cache->epoch);
+    for (uint32_t t = 0; t < MAX_THREADS; t++) {
+        uint64_t e = atomic_load(&cache->reader_epoch[t]);
+        if (e != 0 && e < oldest) oldest = e;
+    }
+
+    pthread_mutex_lock(&cache->retire_lock);
+    snapshot_t **link = &cache->retired;
+    while (*link) {
+        snapshot_t *snap = *link;
+        if (snap->retired_epoch <= oldest) {
+            *link = snap->next_retired;
+            free_snapshot(snap);
+            atomic_fetch_sub(&cache->retired_count, 1);
+        } else {
+            link = &snap->next_retired;
+        }
+    }
+    pthread_mutex_unlock(&cache->retire_lock);
+}
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 1469598103934665603ull;
+    for (; *path; path++) h = (h ^ (uint8_t)*path) * 1099511628211ull;
+    return h;
+}
+
+static image_slot_t *find_slot(query_cache_t *cache, const char *path, uint64_t hash, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        image_slot_t *slot = &cache->slots[i];
+        if (slot->hash == hash && strcmp(slot->path, path) == 0) return slot;
+    }
+    return NULL;
+}
+
+// Returns the current snapshot of path, loading it or replacing it first if the file's mtime,
+// size or identity changed. The common case is an atomic load plus one stat(). Concurrent
+// refreshes race with compare-and-swap; the loser drops its copy and uses the winner's.
+snapshot_t *get_snapshot(query_cache_t *cache, const char *path, char *err, size_t err_size) {
+    uint64_t hash = hash_path(path);
+    image_slot_t *slot = find_slot(cache, path, hash, atomic_load_explicit(&cache->slot_count, memory_order_acquire));
+    if (!slot) {
+        pthread_mutex_lock(&cache->add_lock);
+        uint32_t count = atomic_load_explicit(&cache->slot_count, memory_order_relaxed);
+        slot = find_slot(cache, path, hash, count);
+        if (!slot && count < MAX_IMAGES) {
+            slot = &cache->slots[count];
+            slot->path = strdup(path);
+            slot->hash = hash;
+            atomic_init(&slot->snap, NULL);
+            if (slot->path) atomic_store_explicit(&cache->slot_count, count + 1, memory_order_release);
+            else slot = NULL;
+        }
+        pthread_mutex_unlock(&cache->add_lock);
+        if (!slot) {
+            snprintf(err, err_size, "image cache full (%u images)", MAX_IMAGES);
+            return NULL;
+        }
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        snprintf(err, err_size, "cannot stat: %s", strerror(errno));
+        return NULL;
+    }
+    snapshot_t *cur = atomic_load_explicit(&slot->snap, memory_order_acquire);
+    if (cur && cur->dev == st.st_dev && cur->ino == st.st_ino && cur->size == (size_t)st.st_size &&
+        cur->mtime.tv_sec == st.st_mtim.tv_sec && cur->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return cur;
+    }
+
+    snapshot_t *fresh = load_snapshot(path, err, err_size);
+    if (!fresh) return NULL;
+    if (atomic_compare_exchange_strong_explicit(&slot->snap, &cur, fresh, memory_order_acq_rel, memory_order_acquire)) {
+        if (cur) {
+            // Other threads may still be reading the old version; reclaim_snapshots() frees it
+            pthread_mutex_lock(&cache->retire_lock);
+            cur->retired_epoch = atomic_fetch_add(&cache->epoch, 1) + 1;
+            cur->next_retired = cache->retired;
+            cache->retired = cur;
+            atomic_fetch_add(&cache->retired_count, 1);
+            pthread_mutex_unlock(&cache->retire_lock);
+            atomic_fetch_add(&cache->refreshes, 1);
+        }
+        return fresh;
+    }
+    free_snapshot(fresh);
+    return cur;
+}
+
+file_entry_t *find_file(snapshot_t *snap, const char *name) {
+    file_entry_t key;
+    if (strlen(name) >= sizeof(key.name)) return NULL;
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return bsearch(&key, snap->files, snap->file_count, sizeof(file_entry_t), compare_entries);
+}
+
+// data must hold DIRECT_MAX * BS bytes. Returns -1 for a bad block list, -2 if the file
+// was truncated underneath the mapping.
+int read_file(const snapshot_t *snap, const file_entry_t *f, uint8_t *data) {
+    uint64_t size = f->inode.size_bytes;
+    if (size > DIRECT_MAX * BS) return -1;
+    for (uint32_t b = 0; (uint64_t)b * BS < size; b++) {
+        uint64_t blk = f->inode.direct[b];
+        if (blk == 0 || (blk + 1) * BS > snap->size) return -1;
+        uint64_t n = size - (uint64_t)b * BS < BS ? size - (uint64_t)b * BS : BS;
+        if (copy_from_map(data + (uint64_t)b * BS, snap->base + blk * BS, n) != 0) return -2;
+    }
+    return 0;
+}
+
+// Memoised in the entry; threads racing on the first computation store the same value
+int file_crc(const snapshot_t *snap, file_entry_t *f, uint32_t *crc) {
+    uint64_t cached = atomic_load_explicit(&f->crc, memory_order_relaxed);
+    if (cached & CRC_VALID) {
+        *crc = (uint32_t)cached;
+        return 0;
+    }
+
+    static _Thread_local uint8_t data[DIRECT_MAX * BS];
+    int rc = read_file(snap, f, data);
+    if (rc != 0) return rc;
+    *crc = crc32(data, f->inode.size_bytes);
+    atomic_store_explicit(&f->crc, CRC_VALID | *crc, memory_order_relaxed);
+    return 0;
+}
+
+static const char *read_error(int rc) {
+    return rc == -2 ? "image truncated while reading" : "corrupt block list";
+}
+
+// Requests are "<verb> <image> [<name>]"; the name is the rest of the line and may hold spaces
+void handle_request(query_cache_t *cache, char *line, FILE *out) {
+    char *save = NULL;            // strtok() keeps its position in a global shared by all workers
+    char *verb = strtok_r(line, " \t", &save);
+    char *image = verb ? strtok_r(NULL, " \t", &save) : NULL;
+    char *name = image ? strtok_r(NULL, "", &save) : NULL;
+    while (name && (*name == ' ' || *name == '\t')) name++;
+    if (!verb) return;
+    atomic_fetch_add(&cache->requests, 1);
+
+    int wants_name = strcmp(verb, "stat") == 0 || strcmp(verb, "read") == 0;
+    if (!image || (wants_name && (!name || !*name)) || (!wants_name && strcmp(verb, "list") != 0)) {
+        fprintf(out, "ERR %s: bad request\n", verb);
+        return;
+    }
+
+    char err[256];
+    snapshot_t *snap = get_snapshot(cache, image, err, sizeof(err));
+    if (!snap) {
+        fprintf(out, "ERR %s %s: %s\n", verb, image, err);
+        return;
+    }
+
+    if (strcmp(verb, "list") == 0) {
+        for (uint32_t i = 0; i < snap->file_count; i++) {
+            const file_entry_t *f = &snap->files[i];
+            fprintf(out, "FILE %s %s size=%" PRIu64 " inode=%u\n", image, f->name, f->inode.size_bytes, f->inode_no);
+        }
+        fprintf(out, "OK list %s files=%u\n", image, snap->file_count);
+        return;
+    }
+
+    file_entry_t *f = find_file(snap, name);
+    if (!f) {
+        fprintf(out, "ERR %s %s %s: no such file\n", verb, image, name);
+        return;
+    }
+    if (strcmp(verb, "stat") == 0) {
+        uint32_t crc;
+        int rc = file_crc(snap, f, &crc);
+        if (rc != 0) {
+            fprintf(out, "ERR stat %s %s: %s\n", image, name, read_error(rc));
+            return;
+        }
+        fprintf(out, "OK stat %s %s size=%" PRIu64 " mtime=%" PRIu64 " inode=%u crc=%08x\n", image, name,
+                f->inode.size_bytes, f->inode.mtime, f->inode_no, crc);
+        return;
+    }
+
+    static _Thread_local uint8_t data[DIRECT_MAX * BS];
+    int rc = read_file(snap, f, data);
+    if (rc != 0) {
+        fprintf(out, "ERR read %s %s: %s\n", image, name, read_error(rc));
+        return;
+    }
+    fprintf(out, "OK read %s %s bytes=%" PRIu64 "\n", image, name, f->inode.size_bytes);
+    fwrite(data, 1, f->inode.size_bytes, out);
+    fputc('\n', out);
+}
+
+// Each response is assembled in memory and written to stdout in one locked write, so replies
+// from different workers never interleave
+void *query_worker(void *arg) {
+    worker_t *w = arg;
+    query_cache_t *cache = w->cache;
+    atomic_uint_fast64_t *my_epoch = &cache->reader_epoch[w->id];
+    char *line = NULL;
+    size_t cap = 0;
+    for (;;) {
+        pthread_mutex_lock(&cache->input_lock);
+        ssize_t len = getline(&line, &cap, stdin);
+        pthread_mutex_unlock(&cache->input_lock);
+        if (len < 0) break;
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+
+        char *buf = NULL;
+        size_t buf_size = 0;
+        FILE *out = open_memstream(&buf, &buf_size);
+        if (!out) {
+            perror("open_memstream");
+            break;
+        }
+        // Publish the epoch before handle_request() loads any snapshot pointer
+        atomic_store(my_epoch, atomic_load(&cache->epoch));
+        atomic_thread_fence(memory_order_seq_cst);
+        handle_request(cache, line, out);
+        fclose(out);
+        atomic_store(my_epoch, 0);
+        if (atomic_load_explicit(&cache->retired_count, memory_order_relaxed) > 0) reclaim_snapshots(cache);
+
+        flockfile(stdout);
+        fwrite(buf, 1, buf_size, stdout);
+        fflush(stdout);
+        funlockfile(stdout);
+        free(buf);
+    }
+    free(line);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    long threads = 4;
+    static struct option long_options[] = {
+        {"threads", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1 || threads > (long)MAX_THREADS) {
+                    fprintf(stderr, "Error: threads must be between 1 and %u\n", MAX_THREADS);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    static query_cache_t cache;
+    atomic_init(&cache.epoch, 1);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigbus_handler;
+    sa.sa_flags = SA_NODEFER;     // siglongjmp leaves the handler without restoring the mask
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+    pthread_mutex_init(&cache.add_lock, NULL);
+    pthread_mutex_init(&cache.retire_lock, NULL);
+    pthread_mutex_init(&cache.input_lock, NULL);
+
+    pthread_t tids[MAX_THREADS];
+    static worker_t workers[MAX_THREADS];
+    long started = 0;
+    for (; started < threads; started++) {
+        workers[started].cache = &cache;
+        workers[started].id = (uint32_t)started;
+        if (pthread_create(&tids[started], NULL, query_worker, &workers[started]) != 0) break;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: cannot start worker threads\n");
+        return 1;
+    }
+    for (long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+    uint32_t count = atomic_load(&cache.slot_count);
+    fprintf(stderr, "Served %" PRIu64 " requests from %u images (%" PRIu64 " refreshes)\n",
+            (uint64_t)atomic_load(&cache.requests), count, (uint64_t)atomic_load(&cache.refreshes));
+    for (uint32_t i = 0; i < count; i++) {
+        snapshot_t *snap = atomic_load(&cache.slots[i].snap);
+        if (snap) free_snapshot(snap);
+        free(cache.slots[i].path);
+    }
+    while (cache.retired) {
+        snapshot_t *next = cache.retired->next_retired;
+        free_snapshot(cache.retired);
+        cache.retired = next;
+    }
+    return 0;
+}